@@ -3,8 +3,17 @@
 #include <string>
 #include <sstream>
 #include <algorithm>
+#include <cstdlib>
 #include <map>
 #include <vector>
+#include <thread>
+#include <atomic>
+#include <mutex>
+#include <condition_variable>
+#include <deque>
+#include <set>
+#include <exception>
+#include <memory>
 #include <io.h>
 
 using namespace std;
@@ -37,6 +46,15 @@ using namespace std;
 #define THIS 25
 #define INVALID 26
 
+//in streaming mode the tokenizer keeps about this many characters of input ahead of the current token
+#define STREAM_WINDOW 65536
+
+//BatchIO reads at most this many input files ahead of the compiler
+#define READ_AHEAD 64
+
+//BatchIO holds at most about this many bytes of output that still have to be written
+#define WRITE_BEHIND (1 << 20)
+
 class JackTokenizer
 {
 private:
@@ -44,12 +62,16 @@ private:
     {
         string val;
         int type;
+        int line = 0;
+        int column = 0;
 
         Token(){};
-        void set(string &s, int t)
+        void set(string &s, int t, int l, int c)
         {
             val = s;
             type = t;
+            line = l;
+            column = c;
         }
         void reset()
         {
@@ -58,7 +80,24 @@ private:
         }
     };
 
+    //a run of fileBuffer characters that are consecutive in one source line starts at offset.
+    //there is about one per word, as blank collapsing and comments break the runs
+    struct Position
+    {
+        int offset;
+        int line;
+        int column;
+    };
+
     string fileBuffer;
+    vector<Position> positions; //sorted by offset
+    shared_ptr<istream> input; //released once the whole input is in fileBuffer
+    bool streaming = false;
+    bool peeking = false; //keeps the streaming window in place while peek looks ahead
+    int lineNo = 0;
+    bool inLineComment = false;
+    bool inBlockComment = false;
+    char prevChar = 0;
     Token curToken;
     Token prevToken;
     int index = 0;
@@ -88,15 +127,32 @@ private:
     };
     vector<char> symbolList{'{', '}', '(', ')', '[', ']', '.', ',', '.', ';', '+', '-', '*', '/', '&', '|', '<', '>', '=', '_', '~'};
 
-    string removeLineBlank(string &);
-    string removeComments(string &);
+    string removeLineBlank(string &, vector<int> &);
+    string removeComments(string &, vector<int> &);
     bool isSymbol(char);
     bool isKeyword(string &);
     char getNextCharacter();
     void unget();
+    void readLine();
+    void fill();
+
+    //the source line and column of a fileBuffer character
+    void locate(int, int &, int &);
+
+    //the positions of fileBuffer[begin, end), with offsets counted from begin
+    vector<Position> positionsOf(int, int);
+
+    //is fileBuffer[begin, end) a keyword that starts a subroutine, or any class member
+    bool isSubroutine(int, int);
+    bool isClassMember(int, int);
 
 public:
-    JackTokenizer(string &);
+    //reads the .jack file at path, or standard input if path is "-".
+    //without stream the whole input is read up front; with stream only a window of STREAM_WINDOW characters
+    //around the current token is kept in memory
+    JackTokenizer(string &, bool stream = false);
+    //reads the whole input from an already open stream. sizeHint is the expected input size, if known
+    JackTokenizer(istream &, size_t sizeHint = 0);
     JackTokenizer(){};
 
     //are there more tokens in the input
@@ -134,60 +190,168 @@ public:
         return curToken.val;
     }
 
+    //returns the line of the .jack file the current token was read from
+    int lineNumber()
+    {
+        return curToken.line;
+    }
+
+    //returns the column of the .jack file the current token starts at
+    int columnNumber()
+    {
+        return curToken.column;
+    }
+
     void rollBack();
 
+    //returns the value of the n-th token after the current one without consuming it, or "" if there is none
+    string peek(int);
+
     bool isOperator();
+
+    //splits the input at subroutine boundaries, starting at the current token, which must be the first subroutine keyword.
+    //each returned tokenizer holds exactly one subroutine declaration. the split matches braces over the characters
+    //of the input, without tokenizing it. afterwards the next token is the one following the last subroutine
+    vector<JackTokenizer> splitSubroutines();
 };
 
-string JackTokenizer::removeLineBlank(string &line)
+//collapses every run of blanks into a single ' ' and ends the line with ' '.
+//columns receives the source column of each returned character
+string JackTokenizer::removeLineBlank(string &line, vector<int> &columns)
 {
     string re_line;
-    stringstream lst(line);
-    while (!lst.eof())
+    size_t i = 0;
+    while (true)
     {
-        string s;
-        lst >> s;
-        re_line += (s + " ");
+        while (i < line.size() && isspace((unsigned char)line[i]))
+            i++;
+        if (i == line.size())
+            break;
+        while (i < line.size() && !isspace((unsigned char)line[i]))
+        {
+            re_line += line[i];
+            columns.push_back(i + 1);
+            i++;
+        }
+        re_line += ' ';
+        columns.push_back(i + 1);
+        if (i == line.size())
+            return re_line;
     }
+    re_line += ' ';
+    columns.push_back(i + 1);
     return re_line;
 }
 
-string JackTokenizer::removeComments(string &file)
+//removes comments from one line returned by removeLineBlank, together with their columns.
+//block comments can span lines, so the comment state is kept between calls
+string JackTokenizer::removeComments(string &line, vector<int> &columns)
 {
     string s;
-    for (int i = 0; i < file.size(); i++)
+    vector<int> kept;
+    for (size_t i = 0; i < line.size(); i++)
     {
-        if (file[i] == '/' && file[i + 1] == '/')
+        char prev = prevChar;
+        prevChar = line[i];
+        if (inLineComment)
         {
-            while (file[i] != '\n')
-            {
-                i++;
-            }
+            if (line[i] == '\n')
+                inLineComment = false;
         }
-        else if (file[i] == '/' && file[i + 1] == '*')
+        else if (inBlockComment)
         {
-            while (!(file[i] == '/' && file[i - 1] == '*'))
-            {
-                i++;
-            }
-            i += 2; //jump over '\n'
+            if (line[i] == '/' && prev == '*')
+                inBlockComment = false;
         }
-        else if (file[i] == '/' && file[i + 1] == '*' && file[i + 2] == '*')
+        else if (line[i] == '/' && line[i + 1] == '/')
         {
-            while (!(file[i] == '/' && file[i - 1] == '*'))
-            {
-                i++;
-            }
-            i += 2; //jump over '\n'
+            inLineComment = true;
+        }
+        else if (line[i] == '/' && line[i + 1] == '*')
+        {
+            //the '*' of "/*" cannot also close the comment, as in "/*/"
+            inBlockComment = true;
+            i++;
+            prevChar = 0;
         }
         else
         {
-            s += file[i];
+            s += line[i];
+            kept.push_back(columns[i]);
         }
     }
+    columns = kept;
     return s;
 }
 
+void JackTokenizer::readLine()
+{
+    string line;
+    getline(*input, line);
+    lineNo++;
+    vector<int> columns;
+    line = removeLineBlank(line, columns);
+    if (line[0] != ' ')
+    {
+        line += '\n';
+        columns.push_back(columns.back() + 1);
+        line = removeComments(line, columns);
+        int length = line.size();
+        for (int i = 0; i < length; i++)
+        {
+            if (i == 0 || columns[i] != columns[i - 1] + 1)
+                positions.push_back(Position{(int)fileBuffer.size() + i, lineNo, columns[i]});
+        }
+        fileBuffer += line;
+    }
+}
+
+void JackTokenizer::locate(int at, int &line, int &column)
+{
+    auto p = upper_bound(positions.begin(), positions.end(), at, [](int offset, const Position &pos) { return offset < pos.offset; });
+    p--;
+    line = p->line;
+    column = p->column + (at - p->offset);
+}
+
+vector<JackTokenizer::Position> JackTokenizer::positionsOf(int begin, int end)
+{
+    auto first = upper_bound(positions.begin(), positions.end(), begin, [](int offset, const Position &pos) { return offset < pos.offset; });
+    if (first != positions.begin())
+        first--;
+    vector<Position> result;
+    for (auto p = first; p != positions.end() && p->offset < end; p++)
+    {
+        Position pos = *p;
+        if (pos.offset < begin)
+        {
+            pos.column += begin - pos.offset;
+            pos.offset = begin;
+        }
+        pos.offset -= begin;
+        result.push_back(pos);
+    }
+    return result;
+}
+
+//reads input lines until STREAM_WINDOW characters are buffered ahead of the current token,
+//or everything when not streaming
+void JackTokenizer::fill()
+{
+    while (input && (!streaming || fileBuffer.size() - index < STREAM_WINDOW))
+    {
+        if (input->eof())
+        {
+            //the whole input is in memory now, give back what the buffers grew by
+            input.reset();
+            if (!streaming)
+                positions.shrink_to_fit();
+            break;
+        }
+        readLine();
+    }
+}
+
 char JackTokenizer::getNextCharacter()
 {
     char c = fileBuffer[index];
@@ -220,32 +384,33 @@ bool JackTokenizer::isKeyword(string &s)
     return false;
 }
 
-JackTokenizer::JackTokenizer(string &path)
+JackTokenizer::JackTokenizer(string &path, bool stream)
 {
-    ifstream ist = ifstream(path.c_str());
+    if (path == "-")
+        input = shared_ptr<istream>(&cin, [](istream *) {});
+    else
+        input = make_shared<ifstream>(path.c_str());
 
-    if (!ist)
+    if (!*input)
         throw runtime_error("cannot open input file");
 
-    while (!ist.eof())
-    {
-        string line;
-        getline(ist, line);
-        line = removeLineBlank(line);
-        if (line[0] != ' ')
-        {
-            line += '\n';
-            fileBuffer += line;
-        }
-    }
-
-    fileBuffer = removeComments(fileBuffer);
+    streaming = stream;
+    fill();
     //cout << fileBuffer.size() << endl;
     //cout << fileBuffer << endl;
 }
 
+JackTokenizer::JackTokenizer(istream &ist, size_t sizeHint)
+{
+    //collapsing blanks keeps fileBuffer at about the size of the input, so it rarely has to grow while it is read
+    fileBuffer.reserve(sizeHint);
+    input = shared_ptr<istream>(&ist, [](istream *) {});
+    fill();
+}
+
 bool JackTokenizer::hasMoreTokens()
 {
+    fill();
     return index < fileBuffer.size();
 }
 
@@ -257,8 +422,19 @@ void JackTokenizer::advance()
     if (index != 0)
         previndex = index;
 
+    //drop the input before the current token once a full window of it has been consumed
+    if (streaming && !peeking && previndex >= STREAM_WINDOW)
+    {
+        positions = positionsOf(previndex, fileBuffer.size());
+        fileBuffer.erase(0, previndex);
+        index -= previndex;
+        previndex = 0;
+    }
+
     if (hasMoreTokens())
     {
+        int line, column;
+        locate(index, line, column);
         char c = getNextCharacter();
         string curValue;
 
@@ -268,10 +444,12 @@ void JackTokenizer::advance()
             c = getNextCharacter();
             do
             {
+                if (c == '\n')
+                    throw runtime_error("unterminated string constant!");
                 curValue += c;
                 c = getNextCharacter();
             } while (c != '"');
-            curToken.set(curValue, STRING_CONST);
+            curToken.set(curValue, STRING_CONST, line, column);
         }
         //handle keyword or indentifier
         else if (isalpha(c))
@@ -282,9 +460,9 @@ void JackTokenizer::advance()
                 c = getNextCharacter();
             }
             if (isKeyword(curValue))
-                curToken.set(curValue, KEYWORD);
+                curToken.set(curValue, KEYWORD, line, column);
             else
-                curToken.set(curValue, IDENTIFIER);
+                curToken.set(curValue, IDENTIFIER, line, column);
 
             unget();
         }
@@ -296,7 +474,7 @@ void JackTokenizer::advance()
                 curValue += c;
                 c = getNextCharacter();
             }
-            curToken.set(curValue, INT_CONST);
+            curToken.set(curValue, INT_CONST, line, column);
 
             unget();
         }
@@ -304,12 +482,12 @@ void JackTokenizer::advance()
         else if (isSymbol(c))
         {
             curValue = c;
-            curToken.set(curValue, SYMBOL);
+            curToken.set(curValue, SYMBOL, line, column);
         }
         else if (isspace(c))
         {
-            if (index == fileBuffer.size())
-                curToken.set(curValue, NULL);
+            if (!hasMoreTokens())
+                curToken.set(curValue, NULL, line, column);
             if (hasMoreTokens())
                 advance();
         }
@@ -318,6 +496,10 @@ void JackTokenizer::advance()
             throw runtime_error("invalid input Token!");
         }
     }
+    else
+    {
+        throw runtime_error("unexpected end of file!");
+    }
 }
 
 int JackTokenizer::tokenType()
@@ -373,6 +555,143 @@ void JackTokenizer::rollBack()
     index = previndex;
 }
 
+string JackTokenizer::peek(int n)
+{
+    Token cur = curToken;
+    Token prev = prevToken;
+    int savedIndex = index;
+    int savedPrevindex = previndex;
+    string val;
+    peeking = true;
+    try
+    {
+        for (int i = 0; i < n && hasMoreTokens(); i++)
+        {
+            advance();
+            val = (i == n - 1) ? curToken.val : "";
+        }
+    }
+    catch (runtime_error &)
+    {
+        val = "";
+    }
+    peeking = false;
+    curToken = cur;
+    prevToken = prev;
+    index = savedIndex;
+    previndex = savedPrevindex;
+    return val;
+}
+
+bool JackTokenizer::isSubroutine(int begin, int end)
+{
+    return fileBuffer.compare(begin, end - begin, "function") == 0 || fileBuffer.compare(begin, end - begin, "method") == 0 ||
+           fileBuffer.compare(begin, end - begin, "constructor") == 0;
+}
+
+bool JackTokenizer::isClassMember(int begin, int end)
+{
+    return isSubroutine(begin, end) || fileBuffer.compare(begin, end - begin, "static") == 0 || fileBuffer.compare(begin, end - begin, "field") == 0;
+}
+
+vector<JackTokenizer> JackTokenizer::splitSubroutines()
+{
+    vector<JackTokenizer> parts;
+    int size = fileBuffer.size();
+    int begin = previndex;
+    while (true)
+    {
+        //match braces over the characters of the subroutine, skipping string constants.
+        //a class member keyword means the subroutine was not closed. the part then ends with that keyword,
+        //as a serial build sees it
+        int depth = 0;
+        int pos = begin;
+        int member = -1; //start of the class member keyword that cut the part short
+        bool first = true;
+        while (pos < size)
+        {
+            char c = fileBuffer[pos];
+            if (c == '"')
+            {
+                //an unterminated string constant ends at the end of its line
+                pos++;
+                while (pos < size && fileBuffer[pos] != '"' && fileBuffer[pos] != '\n')
+                    pos++;
+                pos++;
+            }
+            else if (isalpha(c))
+            {
+                int start = pos;
+                while (pos < size && fileBuffer[pos] != ' ' && (!isSymbol(fileBuffer[pos]) || fileBuffer[pos] == '_'))
+                    pos++;
+                if (!first && isClassMember(start, pos))
+                {
+                    member = start;
+                    break;
+                }
+                first = false;
+            }
+            else if (isdigit(c))
+            {
+                while (pos < size && isdigit(fileBuffer[pos]))
+                    pos++;
+            }
+            else
+            {
+                pos++;
+                if (c == '{')
+                    depth++;
+                else if (c == '}' && --depth == 0)
+                    break;
+            }
+        }
+        pos = min(pos, size);
+
+        JackTokenizer part;
+        if (member >= 0)
+        {
+            //keywords end at a blank, which the cut would remove
+            part.fileBuffer = fileBuffer.substr(begin, pos - begin) + ' ';
+            part.positions = positionsOf(begin, pos);
+            parts.push_back(part);
+            index = previndex = member;
+            if (!isSubroutine(member, pos))
+                return parts;
+            begin = member;
+            continue;
+        }
+
+        part.fileBuffer = fileBuffer.substr(begin, pos - begin);
+        part.positions = positionsOf(begin, pos);
+        parts.push_back(part);
+
+        //the closing '}' of the subroutine becomes the current token
+        index = previndex = pos;
+        if (pos == size)
+        {
+            //like the NULL token advance returns at the end of the input
+            int line, column;
+            locate(size - 1, line, column);
+            string none;
+            curToken.set(none, NULL, line, column);
+            return parts;
+        }
+        int line, column;
+        locate(pos - 1, line, column);
+        string brace = "}";
+        curToken.set(brace, SYMBOL, line, column);
+
+        //go on if another subroutine follows
+        size_t next = fileBuffer.find_first_not_of(" \n", pos);
+        if (next == string::npos)
+            return parts;
+        size_t end = fileBuffer.find_first_of(" \n", next);
+        if (!isSubroutine(next, end == string::npos ? size : end))
+            return parts;
+        begin = next;
+    }
+}
+
 bool JackTokenizer::isOperator()
 {
     if (tokenType() == SYMBOL)
@@ -403,17 +722,709 @@ bool JackTokenizer::isOperator()
     return false;
 }
 
-class CompilationEngine
-{
-private:
-    JackTokenizer tokenizer;
-    ofstream ost;
+//bundles hold many files in one, so a build reads and writes a single file instead of one per class.
+//layout, all integers little endian:
+//  "JACKBNDL"                                                   8 bytes
+//  uint32 count
+//  count x { uint64 offset, uint64 size, uint64 nameOffset }     24 bytes each, sorted by name
+//  names and contents, at the given offsets from the start of the bundle. names end with '\0'
+//entry i of the table starts at byte 12 + 24 * i, so any file can be found without reading the others
+
+//an input stream over a string that reads it in place, without the copy istringstream makes
+struct StringBuffer : streambuf
+{
+    StringBuffer(string &s)
+    {
+        setg(&s[0], &s[0], &s[0] + s.size());
+    }
+};
+
+//tokenizes the text of a whole file. the text is released once it is tokenized
+JackTokenizer tokenizeText(string text)
+{
+    StringBuffer buffer(text);
+    istream ist(&buffer);
+    return JackTokenizer(ist, text.size() + 1);
+}
+
+static void putInt(string &s, unsigned long long v, int bytes)
+{
+    for (int i = 0; i < bytes; i++)
+        s += (char)((v >> (8 * i)) & 0xff);
+}
+
+static unsigned long long getInt(string &s, long long pos, int bytes)
+{
+    unsigned long long v = 0;
+    for (int i = 0; i < bytes; i++)
+        v |= (unsigned long long)(unsigned char)s[pos + i] << (8 * i);
+    return v;
+}
+
+void writeBundle(string &path, vector<pair<string, string>> &files)
+{
+    sort(files.begin(), files.end());
+
+    string table;
+    string data;
+    long long dataStart = 12 + 24 * (long long)files.size();
+    putInt(table, files.size(), 4);
+    for (auto &file : files)
+    {
+        long long nameOffset = dataStart + data.size();
+        data += file.first + '\0';
+        putInt(table, dataStart + data.size(), 8);
+        putInt(table, file.second.size(), 8);
+        putInt(table, nameOffset, 8);
+        data += file.second;
+    }
+
+    ofstream ost(path.c_str(), ios::binary);
+    ost << "JACKBNDL" << table << data;
+}
+
+//the outputs of a bundle member are written next to its name, so it must stay inside the current directory
+static void checkBundleName(string &name)
+{
+    bool absolute = name.empty() || name[0] == '/' || name[0] == '\\' || (name.size() > 1 && name[1] == ':');
+    bool parent = false;
+    for (size_t begin = 0; begin <= name.size();)
+    {
+        size_t end = name.find_first_of("/\\", begin);
+        if (end == string::npos)
+            end = name.size();
+        if (name.compare(begin, end - begin, "..") == 0)
+            parent = true;
+        begin = end + 1;
+    }
+    if (absolute || parent)
+        throw runtime_error("bundle member " + name + " is not a relative path inside the bundle!");
+}
+
+//reads a bundle written by writeBundle, or a tar archive
+void readBundle(string &path, vector<string> &names, vector<string> &contents)
+{
+    ifstream ist(path.c_str(), ios::binary);
+    if (!ist)
+        throw runtime_error("cannot open bundle file");
+    stringstream sst;
+    sst << ist.rdbuf();
+    string bundle = sst.str();
+
+    if (bundle.compare(0, 8, "JACKBNDL") == 0)
+    {
+        if (bundle.size() < 12)
+            throw runtime_error("corrupt bundle file!");
+        unsigned long long count = getInt(bundle, 8, 4);
+        if (count > (bundle.size() - 12) / 24)
+            throw runtime_error("corrupt bundle file!");
+        for (unsigned long long i = 0; i < count; i++)
+        {
+            long long entry = 12 + 24 * (long long)i;
+            unsigned long long offset = getInt(bundle, entry, 8);
+            unsigned long long size = getInt(bundle, entry + 8, 8);
+            unsigned long long nameOffset = getInt(bundle, entry + 16, 8);
+            if (offset > bundle.size() || size > bundle.size() - offset || nameOffset >= bundle.size() || bundle.find('\0', nameOffset) == string::npos)
+                throw runtime_error("corrupt bundle file!");
+            names.push_back(string(bundle.c_str() + nameOffset));
+            checkBundleName(names.back());
+            contents.push_back(bundle.substr(offset, size));
+        }
+    }
+    else if (bundle.size() >= 512 && bundle.compare(257, 5, "ustar") == 0)
+    {
+        //512 byte header blocks, each followed by the file content padded to 512 bytes
+        for (long long pos = 0; pos + 512 <= (long long)bundle.size() && bundle[pos] != '\0';)
+        {
+            string name = bundle.substr(pos, 100).c_str();
+            string prefix = bundle.substr(pos + 345, 155).c_str();
+            if (!prefix.empty())
+                name = prefix + "/" + name;
+            long long size = strtoll(bundle.substr(pos + 124, 12).c_str(), nullptr, 8);
+            if (size < 0 || size > (long long)bundle.size() - pos - 512)
+                throw runtime_error("corrupt bundle file!");
+            char type = bundle[pos + 156];
+            if (type == '0' || type == '\0')
+            {
+                checkBundleName(name);
+                names.push_back(name);
+                contents.push_back(bundle.substr(pos + 512, size));
+            }
+            pos += 512 + (size + 511) / 512 * 512;
+        }
+    }
+    else
+    {
+        throw runtime_error("unknown bundle format!");
+    }
+}
+
+//reads every input file in one piece and writes every output file on a background thread,
+//so file system latency overlaps with compilation instead of adding up file by file
+class BatchIO
+{
+private:
+    vector<string> inputs;
+    map<string, int> inputIndex;
+    vector<string> contents;
+    vector<int> state; //0: not read yet, 1: read, 2: cannot open
+    int consumed = 0;
+    deque<pair<string, string>> pending;
+    size_t pendingBytes = 0;
+    string bundlePath;
+    string bundleRoot;
+    vector<pair<string, string>> bundled;
+    bool finished = false;
+    mutex lock;
+    condition_variable changed;
+    thread worker;
+
+    void run();
+
+public:
+    BatchIO(vector<string> &);
+    //input files whose contents are already known, e.g. from a bundle
+    BatchIO(vector<string> &, vector<string> &);
+    ~BatchIO();
+
+    //collects all outputs into one bundle written by finish(). root is removed from the front of the output paths
+    void bundleOutput(string &path, string &root);
+
+    //are the outputs collected into a bundle
+    bool bundling()
+    {
+        lock_guard<mutex> lk(lock);
+        return !bundlePath.empty();
+    }
+
+    //returns the content of an input file, waiting for it to be read if needed
+    string read(string &);
+
+    //queues an output file to be written, taking over its content.
+    //waits for earlier outputs to be written first if more than WRITE_BEHIND bytes are queued
+    void write(string, string &&);
+
+    //writes all queued output files and stops the background thread
+    void finish();
+};
+
+BatchIO::BatchIO(vector<string> &files) : inputs(files), contents(files.size()), state(files.size())
+{
+    for (size_t i = 0; i < inputs.size(); i++)
+        inputIndex[inputs[i]] = i;
+    worker = thread(&BatchIO::run, this);
+}
+
+BatchIO::BatchIO(vector<string> &files, vector<string> &fileContents) : inputs(files), contents(fileContents), state(files.size(), 1)
+{
+    for (size_t i = 0; i < inputs.size(); i++)
+        inputIndex[inputs[i]] = i;
+    worker = thread(&BatchIO::run, this);
+}
+
+void BatchIO::bundleOutput(string &path, string &root)
+{
+    lock_guard<mutex> lk(lock);
+    bundlePath = path;
+    bundleRoot = root;
+}
+
+BatchIO::~BatchIO()
+{
+    finish();
+}
+
+void BatchIO::run()
+{
+    int next = 0;
+    unique_lock<mutex> lk(lock);
+    while (true)
+    {
+        while (next < (int)inputs.size() && state[next] != 0)
+            next++;
+
+        //inputs go first, the compiler is waiting for them
+        if (next < (int)inputs.size() && next < consumed + READ_AHEAD)
+        {
+            string path = inputs[next];
+            lk.unlock();
+            ifstream ist(path.c_str());
+            stringstream content;
+            if (ist)
+                content << ist.rdbuf();
+            lk.lock();
+            contents[next] = content.str();
+            state[next] = ist ? 1 : 2;
+            next++;
+            changed.notify_all();
+        }
+        else if (!pending.empty())
+        {
+            pair<string, string> file = move(pending.front());
+            pending.pop_front();
+            lk.unlock();
+            ofstream(file.first) << file.second;
+            lk.lock();
+            pendingBytes -= file.second.size();
+            changed.notify_all();
+        }
+        else if (finished)
+        {
+            break;
+        }
+        else
+        {
+            changed.wait(lk);
+        }
+    }
+}
+
+string BatchIO::read(string &path)
+{
+    int i = inputIndex[path];
+    unique_lock<mutex> lk(lock);
+    changed.wait(lk, [&]() { return state[i] != 0; });
+    consumed = max(consumed, i + 1);
+    changed.notify_all();
+    if (state[i] == 2)
+        throw runtime_error("cannot open input file");
+    return move(contents[i]);
+}
+
+void BatchIO::write(string path, string &&content)
+{
+    unique_lock<mutex> lk(lock);
+    if (!bundlePath.empty())
+    {
+        if (path.compare(0, bundleRoot.size(), bundleRoot) == 0)
+            path = path.substr(bundleRoot.size());
+        bundled.push_back(make_pair(path, move(content)));
+        return;
+    }
+    changed.wait(lk, [&]() { return pending.empty() || pendingBytes + content.size() <= WRITE_BEHIND; });
+    pendingBytes += content.size();
+    pending.push_back(make_pair(path, move(content)));
+    changed.notify_all();
+}
+
+void BatchIO::finish()
+{
+    {
+        lock_guard<mutex> lk(lock);
+        finished = true;
+        changed.notify_all();
+    }
+    if (worker.joinable())
+        worker.join();
+
+    if (!bundlePath.empty())
+    {
+        writeBundle(bundlePath, bundled);
+        bundlePath.clear();
+    }
+}
+
+//the declarations of a class that other classes can use
+struct SubroutineSummary
+{
+    int kind; //CONSTRUCTOR, FUNCTION or METHOD
+    string returnType;
+    string name;
+    vector<string> parameterTypes;
+};
+
+struct ClassSummary
+{
+    string name;
+    int fields = 0;
+    int statics = 0;
+    vector<SubroutineSummary> subroutines;
+};
+
+//class summary files let other builds check and analyze calls into a class without its source.
+//layout, integers little endian, strings as a uint16 length followed by the characters:
+//  "JACKSUM1", uint32 class count, then per class:
+//  name, uint16 fields, uint16 statics, uint16 subroutine count, then per subroutine:
+//  uint8 kind, return type, name, uint8 parameter count, parameter types
+
+static void putString(string &s, string &v)
+{
+    putInt(s, v.size(), 2);
+    s += v;
+}
+
+//throws if a summary file ends before pos + bytes
+static void checkSummarySize(string &s, long long pos, long long bytes)
+{
+    if (pos + bytes > (long long)s.size())
+        throw runtime_error("corrupt summary file!");
+}
+
+static string getString(string &s, long long &pos)
+{
+    checkSummarySize(s, pos, 2);
+    int size = getInt(s, pos, 2);
+    checkSummarySize(s, pos + 2, size);
+    string v = s.substr(pos + 2, size);
+    pos += 2 + size;
+    return v;
+}
+
+void writeSummaries(string &path, vector<ClassSummary> &classes)
+{
+    string data = "JACKSUM1";
+    putInt(data, classes.size(), 4);
+    for (ClassSummary &cls : classes)
+    {
+        putString(data, cls.name);
+        putInt(data, cls.fields, 2);
+        putInt(data, cls.statics, 2);
+        putInt(data, cls.subroutines.size(), 2);
+        for (SubroutineSummary &sub : cls.subroutines)
+        {
+            putInt(data, sub.kind, 1);
+            putString(data, sub.returnType);
+            putString(data, sub.name);
+            putInt(data, sub.parameterTypes.size(), 1);
+            for (string &type : sub.parameterTypes)
+                putString(data, type);
+        }
+    }
+
+    ofstream ost(path.c_str(), ios::binary);
+    ost << data;
+}
+
+void readSummaries(string &path, vector<ClassSummary> &classes)
+{
+    ifstream ist(path.c_str(), ios::binary);
+    if (!ist)
+        throw runtime_error("cannot open summary file");
+    stringstream sst;
+    sst << ist.rdbuf();
+    string data = sst.str();
+
+    if (data.compare(0, 8, "JACKSUM1") != 0)
+        throw runtime_error("not a class summary file!");
+
+    checkSummarySize(data, 8, 4);
+    long long pos = 12;
+    int count = getInt(data, 8, 4);
+    for (int i = 0; i < count; i++)
+    {
+        ClassSummary cls;
+        cls.name = getString(data, pos);
+        checkSummarySize(data, pos, 6);
+        cls.fields = getInt(data, pos, 2);
+        cls.statics = getInt(data, pos + 2, 2);
+        int subCount = getInt(data, pos + 4, 2);
+        pos += 6;
+        for (int j = 0; j < subCount; j++)
+        {
+            SubroutineSummary sub;
+            checkSummarySize(data, pos, 1);
+            sub.kind = getInt(data, pos, 1);
+            pos++;
+            sub.returnType = getString(data, pos);
+            sub.name = getString(data, pos);
+            checkSummarySize(data, pos, 1);
+            int parameterCount = getInt(data, pos, 1);
+            pos++;
+            for (int k = 0; k < parameterCount; k++)
+                sub.parameterTypes.push_back(getString(data, pos));
+            cls.subroutines.push_back(sub);
+        }
+        classes.push_back(cls);
+    }
+}
+
+//whole-program call graph, built from subroutine declarations and call sites of every input file.
+//subroutines are named "className.subroutineName"
+class CallGraph
+{
+private:
+    map<string, vector<string>> callees;
+    map<string, vector<string>> subroutines; //class name -> subroutines in declaration order
+    map<string, bool> live;
+    set<string> classes;
+    set<string> declared;
+    bool filtering = false; //set once the entry point was found
+    long savedBytes = 0;
+
+    string resolveClass(string &, map<string, string> &, map<string, string> &);
+
+public:
+    //scans the tokens of a .jack file and records its subroutines and their call sites.
+    //works on a copy, so the same tokenizer can be handed to the CompilationEngine afterwards
+    void addFile(JackTokenizer);
+
+    //records the subroutines of a class that is only known from its summary
+    void addSummary(ClassSummary &);
+
+    //marks every subroutine reachable from the given entry point as live.
+    //returns false, and keeps every subroutine, if the entry point is not declared in a scanned file
+    bool markLive(string);
+
+    //is the named subroutine of the class reachable. subroutines the call graph does not know are kept
+    bool isLive(string &, string);
+
+    void addSavedBytes(long bytes)
+    {
+        savedBytes += bytes;
+    }
+
+    //prints the eliminated subroutines, the output bytes saved and calls to undeclared subroutines.
+    //only calls into classes known from the sources or a summary are checked, so OS calls need an OS summary
+    void report();
+};
+
+//a call "name.sub()" goes to the type of the variable "name" if there is one, otherwise "name" is a class
+string CallGraph::resolveClass(string &name, map<string, string> &localTypes, map<string, string> &classTypes)
+{
+    if (localTypes.count(name))
+        return localTypes[name];
+    if (classTypes.count(name))
+        return classTypes[name];
+    return name;
+}
+
+void CallGraph::addFile(JackTokenizer tokenizer)
+{
+    vector<string> tokens;
+    vector<int> types;
+    while (tokenizer.hasMoreTokens())
+    {
+        //syntax errors are reported by the CompilationEngine, the call graph just skips what it cannot read
+        try
+        {
+            tokenizer.advance();
+        }
+        catch (runtime_error &)
+        {
+            continue;
+        }
+        //string constants never name a class or subroutine, so "class" or "(" inside one must not be matched
+        if (!tokenizer.tokenVal().empty() && tokenizer.tokenType() < STRING_CONST)
+        {
+            tokens.push_back(tokenizer.tokenVal());
+            types.push_back(tokenizer.tokenType());
+        }
+    }
+
+    string className;
+    string current;
+    map<string, string> classTypes;
+    map<string, string> localTypes;
+    int depth = 0;
+    int n = tokens.size();
+    for (int i = 0; i < n; i++)
+    {
+        string &t = tokens[i];
+        int type = types[i];
+        if (type == SYMBOL && t == "{")
+            depth++;
+        else if (type == SYMBOL && t == "}")
+            depth--;
+        else if (type == KEYWORD && t == "class" && className.empty() && i + 1 < n)
+        {
+            className = tokens[i + 1];
+            classes.insert(className);
+        }
+        else if (type == KEYWORD && (t == "static" || t == "field" || t == "var") && i + 1 < n)
+        {
+            //type name (, name)* ;
+            map<string, string> &varTypes = (t == "var") ? localTypes : classTypes;
+            string varType = tokens[i + 1];
+            for (i += 2; i < n && !(types[i] == SYMBOL && tokens[i] == ";"); i++)
+            {
+                if (types[i] == IDENTIFIER)
+                    varTypes[tokens[i]] = varType;
+            }
+        }
+        else if (type == KEYWORD && (t == "function" || t == "method" || t == "constructor") && depth == 1 && i + 2 < n)
+        {
+            current = className + "." + tokens[i + 2];
+            subroutines[className].push_back(current);
+            declared.insert(current);
+            callees[current];
+            localTypes.clear();
+
+            //parameter list: (type name (, type name)*)
+            for (i += 4; i + 1 < n && !(types[i] == SYMBOL && tokens[i] == ")"); i++)
+            {
+                if (types[i] != SYMBOL)
+                {
+                    localTypes[tokens[i + 1]] = tokens[i];
+                    i++;
+                }
+            }
+        }
+        else if (depth >= 2 && type == SYMBOL && t == "(" && i > 0)
+        {
+            //subroutine call: name(...) or name.sub(...)
+            if (i >= 3 && types[i - 2] == SYMBOL && tokens[i - 2] == "." && types[i - 3] == IDENTIFIER)
+                callees[current].push_back(resolveClass(tokens[i - 3], localTypes, classTypes) + "." + tokens[i - 1]);
+            else if (types[i - 1] == IDENTIFIER && !(i >= 2 && types[i - 2] == SYMBOL && tokens[i - 2] == "."))
+                callees[current].push_back(className + "." + tokens[i - 1]);
+        }
+    }
+}
+
+void CallGraph::addSummary(ClassSummary &cls)
+{
+    classes.insert(cls.name);
+    for (SubroutineSummary &sub : cls.subroutines)
+        declared.insert(cls.name + "." + sub.name);
+}
+
+bool CallGraph::markLive(string entry)
+{
+    //an entry point known only from a summary has no call sites to follow
+    if (!callees.count(entry))
+        return false;
+    filtering = true;
+    vector<string> worklist{entry};
+    while (!worklist.empty())
+    {
+        string s = worklist.back();
+        worklist.pop_back();
+        if (live[s])
+            continue;
+        live[s] = true;
+        for (string &callee : callees[s])
+        {
+            if (!live[callee])
+                worklist.push_back(callee);
+        }
+    }
+    return true;
+}
+
+bool CallGraph::isLive(string &className, string name)
+{
+    string sub = className + "." + name;
+    if (!filtering || !declared.count(sub))
+        return true;
+    return live[sub];
+}
+
+void CallGraph::report()
+{
+    int eliminated = 0;
+    for (auto &cls : subroutines)
+    {
+        for (string &s : cls.second)
+        {
+            if (filtering && !live[s])
+            {
+                cerr << "eliminated " << s << endl;
+                eliminated++;
+            }
+        }
+    }
+    cerr << "whole-program: " << eliminated << " subroutines eliminated, " << savedBytes << " bytes saved" << endl;
+
+    set<pair<string, string>> reported;
+    for (auto &caller : callees)
+    {
+        for (string &callee : caller.second)
+        {
+            string cls = callee.substr(0, callee.find('.'));
+            if (declared.count(callee) || !classes.count(cls) || reported.count(make_pair(caller.first, callee)))
+                continue;
+            reported.insert(make_pair(caller.first, callee));
+            cerr << "warning: " << caller.first << " calls undeclared subroutine " << callee << endl;
+        }
+    }
+}
+
+//a syntax error found while compiling, at the line and column of the current token
+struct Diagnostic
+{
+    int line;
+    int column;
+    string message;
+};
+
+class CompilationEngine
+{
+private:
+    JackTokenizer tokenizer;
+    ofstream ost;
+    stringstream buffer;
+    ostream *out;
+    CallGraph *callGraph;
+    string className;
+    bool discard = false;
+    long discardedBytes = 0;
+    ofstream mapst;
+    stringstream mapBuffer;
+    ostream *mapOut = nullptr;
+    int outputLine = 0;
+    string subroutineName;
+    int jobs = 1;
+    ClassSummary classSummary;
+    bool summarize = false; //record classSummary, only needed for --emit-summary
+    vector<string> openTags;
+    vector<Diagnostic> errors;
+    string outPath;
+    string mapPath;
+    bool canSpill = false;
+
+    void writeLine(string);
+
+    //writes an output buffer that grew past WRITE_BEHIND to its file and continues writing there directly
+    void spill();
+    void writeXML();
+
+    //records a syntax error at the current token
+    void reportError(string);
+
+    //writes the closing tags of the open elements until only depth of them are left open
+    void closeTags(int);
+
+    //error recovery: skips the rest of a broken statement, stopping at a statement keyword or '}', or after a ';'.
+    //a block opened by the skipped tokens is skipped up to its matching '}'
+    void skipToStatement();
+
+    //error recovery: skips to the next class variable or subroutine declaration, or to the '}' closing the class
+    void skipToClassMember();
+
+    //is the current token a keyword that starts a class variable or subroutine declaration
+    bool atClassMember();
+
+    //is the current token a '}' or a keyword that starts a statement or a class member.
+    //a statement running into one of them is missing its end
+    bool atStatementEnd();
 
-    void writeLine(string);
-    void writeXML();
+    //throws if the current token is at the end of a statement, leaving the previous token as the current one
+    void checkStatementEnd(string);
+
+    //compiles the single subroutine held by the tokenizer into buffer and mapBuffer. used by the parallel workers
+    CompilationEngine(JackTokenizer &, string &, bool, bool, bool);
+
+    //compiles the remaining subroutines of the class on up to jobs threads and writes them in source order
+    void CompileSubroutinesParallel();
 
 public:
-    CompilationEngine(JackTokenizer &, string &);
+    //when sourceMap is set, a .map file is written next to the output, mapping every output line to
+    //"outputLine jackLine Class.subroutine".
+    //with jobs > 1 the subroutines of the class are compiled concurrently.
+    //with io the output is handed to BatchIO instead of being written directly.
+    //with summarize the declarations of the class are recorded for summary()
+    CompilationEngine(JackTokenizer &, string &, CallGraph * = nullptr, bool sourceMap = false, int jobs = 1, BatchIO *io = nullptr, bool summarize = false);
+
+    //the declarations of the compiled class, if they were recorded
+    ClassSummary &summary()
+    {
+        return classSummary;
+    }
+
+    //the syntax errors found in the class, in source order
+    vector<Diagnostic> &diagnostics()
+    {
+        return errors;
+    }
 
     //compiles a complete class
     void CompileClass();
@@ -466,7 +1477,159 @@ public:
 
 void CompilationEngine::writeLine(string s)
 {
-    ost << s << endl;
+    //remember the open elements, so they can be closed when recovering from an error
+    if (s.find(' ') == string::npos)
+    {
+        if (s[1] != '/')
+            openTags.push_back(s.substr(1, s.size() - 2));
+        else if (!openTags.empty())
+            openTags.pop_back();
+    }
+
+    if (discard)
+    {
+        discardedBytes += s.size() + 1;
+        return;
+    }
+    *out << s << "\n";
+    outputLine++;
+    if (mapOut)
+    {
+        *mapOut << outputLine << " " << tokenizer.lineNumber();
+        if (!className.empty())
+            *mapOut << " " << className;
+        if (!className.empty() && !subroutineName.empty())
+            *mapOut << "." << subroutineName;
+        *mapOut << "\n";
+    }
+    if (canSpill && outputLine % 1024 == 0)
+        spill();
+}
+
+void CompilationEngine::spill()
+{
+    if (out == &buffer && buffer.tellp() > WRITE_BEHIND)
+    {
+        ost = ofstream(outPath);
+        ost << buffer.rdbuf();
+        buffer.str(string());
+        out = &ost;
+    }
+    if (mapOut == &mapBuffer && mapBuffer.tellp() > WRITE_BEHIND)
+    {
+        mapst = ofstream(mapPath);
+        mapst << mapBuffer.rdbuf();
+        mapBuffer.str(string());
+        mapOut = &mapst;
+    }
+}
+
+void CompilationEngine::reportError(string message)
+{
+    Diagnostic d{tokenizer.lineNumber(), tokenizer.columnNumber(), message};
+    //errors rethrown while unwinding from the end of the file are only reported once
+    if (!errors.empty() && errors.back().line == d.line && errors.back().column == d.column && errors.back().message == d.message)
+        return;
+    errors.push_back(d);
+}
+
+void CompilationEngine::closeTags(int depth)
+{
+    while ((int)openTags.size() > depth)
+        writeLine("</" + openTags.back() + ">");
+}
+
+void CompilationEngine::skipToStatement()
+{
+    bool moved = false;
+    int depth = 0; //braces opened by the skipped tokens
+    while (true)
+    {
+        //class members cannot be inside a subroutine, not even in an unclosed block
+        if (atClassMember())
+            return;
+        if (depth == 0 && tokenizer.tokenType() == SYMBOL && tokenizer.symbol() == '}')
+            return;
+        if (depth == 0 && moved && tokenizer.tokenType() == KEYWORD)
+        {
+            int keyword = tokenizer.keyWord();
+            if (keyword == LET || keyword == DO || keyword == IF || keyword == WHILE || keyword == RETURN)
+                return;
+        }
+        bool end = depth == 0 && tokenizer.tokenType() == SYMBOL && tokenizer.symbol() == ';';
+        if (tokenizer.tokenType() == SYMBOL && tokenizer.symbol() == '{')
+            depth++;
+        else if (tokenizer.tokenType() == SYMBOL && tokenizer.symbol() == '}')
+            depth--;
+
+        if (!tokenizer.hasMoreTokens())
+            throw runtime_error("unexpected end of file!");
+        try
+        {
+            tokenizer.advance();
+        }
+        catch (runtime_error &)
+        {
+        }
+        moved = true;
+
+        if (end)
+            return;
+    }
+}
+
+void CompilationEngine::skipToClassMember()
+{
+    int depth = 0; //braces opened by the skipped tokens
+    while (tokenizer.hasMoreTokens())
+    {
+        try
+        {
+            tokenizer.advance();
+        }
+        catch (runtime_error &)
+        {
+            continue;
+        }
+        bool closing = tokenizer.tokenType() == SYMBOL && tokenizer.symbol() == '}';
+        if (tokenizer.tokenType() == SYMBOL && tokenizer.symbol() == '{')
+            depth++;
+        else if (closing && depth > 0)
+            depth--;
+        else if (atClassMember() || closing)
+        {
+            tokenizer.rollBack();
+            return;
+        }
+    }
+}
+
+bool CompilationEngine::atClassMember()
+{
+    if (tokenizer.tokenType() != KEYWORD)
+        return false;
+    int keyword = tokenizer.keyWord();
+    return keyword == FUNCTION || keyword == CONSTRUCTOR || keyword == METHOD || keyword == STATIC || keyword == FIELD;
+}
+
+bool CompilationEngine::atStatementEnd()
+{
+    if (tokenizer.tokenType() == SYMBOL)
+        return tokenizer.symbol() == '}';
+    if (tokenizer.tokenType() != KEYWORD)
+        return false;
+    int keyword = tokenizer.keyWord();
+    return keyword == LET || keyword == DO || keyword == IF || keyword == WHILE || keyword == RETURN || atClassMember();
+}
+
+void CompilationEngine::checkStatementEnd(string message)
+{
+    if (atStatementEnd())
+    {
+        //the error is reported at the last token of the statement, and recovery goes on from there
+        tokenizer.rollBack();
+        throw runtime_error(message);
+    }
 }
 
 void CompilationEngine::writeXML()
@@ -520,42 +1683,269 @@ void CompilationEngine::writeXML()
     }
 }
 
-CompilationEngine::CompilationEngine(JackTokenizer &jt, string &s)
+CompilationEngine::CompilationEngine(JackTokenizer &jt, string &s, CallGraph *cg, bool sourceMap, int j, BatchIO *io, bool sum)
 {
     tokenizer = jt;
-    cout << s << endl;
-    ost = ofstream(s);
+    callGraph = cg;
+    jobs = j;
+    summarize = sum;
+    outPath = s;
+    mapPath = s.substr(0, s.size() - 3) + "map";
+    //outputs in a bundle have to stay in memory until the bundle is written
+    canSpill = io && !io->bundling();
+    if (s == "-")
+    {
+        out = &cout;
+    }
+    else
+    {
+        cout << s << endl;
+        if (io)
+        {
+            out = &buffer;
+        }
+        else
+        {
+            ost = ofstream(s);
+            out = &ost;
+        }
+    }
+    if (sourceMap && s != "-")
+    {
+        if (io)
+        {
+            mapOut = &mapBuffer;
+        }
+        else
+        {
+            mapst = ofstream(mapPath);
+            mapOut = &mapst;
+        }
+    }
+
     CompileClass();
+
+    if (callGraph)
+        callGraph->addSavedBytes(discardedBytes);
+    //hand the text over and release the stream's own copy before the next one is made
+    if (io && out == &buffer)
+    {
+        io->write(s, buffer.str());
+        buffer.str(string());
+    }
+    if (io && mapOut == &mapBuffer)
+    {
+        io->write(mapPath, mapBuffer.str());
+        mapBuffer.str(string());
+    }
 }
 
-void CompilationEngine::CompileClass()
+CompilationEngine::CompilationEngine(JackTokenizer &jt, string &cls, bool skip, bool sourceMap, bool sum)
 {
-    writeLine("<class>");
-    while (tokenizer.hasMoreTokens())
+    tokenizer = jt;
+    callGraph = nullptr;
+    className = cls;
+    discard = skip;
+    summarize = sum;
+    out = &buffer;
+    if (sourceMap)
+        mapOut = &mapBuffer;
+    try
     {
         tokenizer.advance();
-        if (tokenizer.tokenType() == KEYWORD)
+        CompileSubroutineDec();
+
+        //tokens left after a recovered error would be class level tokens in a serial build.
+        //a part cut short at the next class member ends with that member's keyword
+        if (tokenizer.hasMoreTokens())
         {
-            int keyword = tokenizer.keyWord();
-            if (keyword == FUNCTION || keyword == CONSTRUCTOR || keyword == METHOD)
+            tokenizer.advance();
+            if (tokenizer.tokenType() != NULL && !atClassMember())
+                throw runtime_error("expected a class variable or subroutine declaration!");
+        }
+    }
+    catch (runtime_error &e)
+    {
+        reportError(e.what());
+        closeTags(0);
+    }
+}
+
+void CompilationEngine::CompileSubroutinesParallel()
+{
+    vector<JackTokenizer> parts = tokenizer.splitSubroutines();
+    vector<string> xml(parts.size());
+    vector<string> maps(parts.size());
+    vector<long> discarded(parts.size());
+    vector<vector<SubroutineSummary>> summaries(parts.size());
+    vector<vector<Diagnostic>> diagnostics(parts.size());
+    int total = parts.size();
+    vector<bool> skip(total);
+    for (int i = 0; i < total; i++)
+        skip[i] = callGraph && !callGraph->isLive(className, parts[i].peek(3));
+
+    //workers take the parts in order and stay at most a few parts ahead of the writer,
+    //so finished parts do not pile up in memory
+    int window = 2 * jobs;
+    int next = 0;
+    int written = 0;
+    vector<bool> done(parts.size());
+    exception_ptr error;
+    mutex lock;
+    condition_variable changed;
+    auto worker = [&]() {
+        while (true)
+        {
+            int i;
+            {
+                unique_lock<mutex> lk(lock);
+                changed.wait(lk, [&]() { return next == total || next < written + window || error; });
+                if (next == total || error)
+                    return;
+                i = next++;
+            }
+            try
             {
-                CompileSubroutineDec();
+                CompilationEngine part(parts[i], className, skip[i], mapOut != nullptr, summarize);
+                parts[i] = JackTokenizer();
+                lock_guard<mutex> lk(lock);
+                xml[i] = part.buffer.str();
+                maps[i] = part.mapBuffer.str();
+                discarded[i] = part.discardedBytes;
+                summaries[i] = part.classSummary.subroutines;
+                diagnostics[i] = part.errors;
+                done[i] = true;
             }
-            else if (keyword == STATIC || keyword == FIELD)
+            catch (...)
+            {
+                lock_guard<mutex> lk(lock);
+                if (!error)
+                    error = current_exception();
+            }
+            changed.notify_all();
+        }
+    };
+
+    vector<thread> threads;
+    for (int t = 0; t < jobs && t < total; t++)
+        threads.push_back(thread(worker));
+
+    //write the parts in source order as soon as each one is finished
+    for (int i = 0; i < total; i++)
+    {
+        {
+            unique_lock<mutex> lk(lock);
+            changed.wait(lk, [&]() { return done[i] || error; });
+            if (error)
+                break;
+        }
+        *out << xml[i];
+        discardedBytes += discarded[i];
+        classSummary.subroutines.insert(classSummary.subroutines.end(), summaries[i].begin(), summaries[i].end());
+        errors.insert(errors.end(), diagnostics[i].begin(), diagnostics[i].end());
+
+        //renumber the map lines of the part to their position in the whole output
+        stringstream mst(maps[i]);
+        string line;
+        while (getline(mst, line))
+        {
+            outputLine++;
+            *mapOut << outputLine << line.substr(line.find(' ')) << "\n";
+        }
+        if (!mapOut)
+            outputLine += count(xml[i].begin(), xml[i].end(), '\n');
+        if (canSpill)
+            spill();
+
+        {
+            lock_guard<mutex> lk(lock);
+            string().swap(xml[i]);
+            string().swap(maps[i]);
+            written++;
+        }
+        changed.notify_all();
+    }
+
+    for (thread &t : threads)
+        t.join();
+    if (error)
+        rethrow_exception(error);
+}
+
+void CompilationEngine::CompileClass()
+{
+    //map the lines before the class name to the class too
+    bool named = false;
+    if (tokenizer.peek(1) == "class")
+        className = tokenizer.peek(2);
+    writeLine("<class>");
+    int braces = 0; //class level braces left open
+    while (tokenizer.hasMoreTokens())
+    {
+        int depth = openTags.size();
+        try
+        {
+            tokenizer.advance();
+            if (tokenizer.tokenType() == KEYWORD)
             {
-                CompileClassVarDec();
+                int keyword = tokenizer.keyWord();
+                if (keyword == FUNCTION || keyword == CONSTRUCTOR || keyword == METHOD)
+                {
+                    if (jobs > 1)
+                    {
+                        CompileSubroutinesParallel();
+                        continue;
+                    }
+                    //in whole-program mode, unreachable subroutines are parsed but not written.
+                    //the name follows the keyword and the return type
+                    discard = callGraph && !callGraph->isLive(className, tokenizer.peek(2));
+                    CompileSubroutineDec();
+                    discard = false;
+                    subroutineName.clear();
+                }
+                else if (keyword == STATIC || keyword == FIELD)
+                {
+                    CompileClassVarDec();
+                }
+                else if (keyword == CLASS)
+                {
+                    writeXML();
+                }
+                else
+                {
+                    throw runtime_error("expected a class variable or subroutine declaration!");
+                }
             }
             else
             {
+                if (tokenizer.tokenType() == IDENTIFIER && !named)
+                {
+                    named = true;
+                    className = tokenizer.identifier();
+                    classSummary.name = className;
+                }
+                else if (!(tokenizer.tokenType() == SYMBOL && (tokenizer.symbol() == '{' || tokenizer.symbol() == '}')) && tokenizer.tokenType() != NULL)
+                {
+                    throw runtime_error("expected a class variable or subroutine declaration!");
+                }
+                if (tokenizer.tokenType() == SYMBOL)
+                    braces += tokenizer.symbol() == '{' ? 1 : -1;
                 writeXML();
+                //cout << tokenizer.tokenVal() << endl;
             }
         }
-        else
+        catch (runtime_error &e)
         {
-            writeXML();
-            //cout << tokenizer.tokenVal() << endl;
+            reportError(e.what());
+            closeTags(depth);
+            discard = false;
+            subroutineName.clear();
+            skipToClassMember();
         }
     }
+    //the class body was never closed
+    if (braces > 0)
+        reportError("unexpected end of file!");
     writeLine("</class>");
 }
 
@@ -563,9 +1953,14 @@ void CompilationEngine::CompileClassVarDec()
 {
     writeLine("<classVarDec>");
     writeXML();
+    int &count = tokenizer.keyWord() == STATIC ? classSummary.statics : classSummary.fields;
+    if (summarize)
+        count++;
     while (!(tokenizer.tokenType() == SYMBOL && tokenizer.symbol() == ';'))
     {
         tokenizer.advance();
+        if (summarize && tokenizer.tokenType() == SYMBOL && tokenizer.symbol() == ',')
+            count++;
         if (tokenizer.tokenType() == KEYWORD || tokenizer.tokenType() == SYMBOL || tokenizer.tokenType() == IDENTIFIER)
         {
             writeXML();
@@ -576,11 +1971,26 @@ void CompilationEngine::CompileClassVarDec()
 
 void CompilationEngine::CompileSubroutineDec()
 {
+    //map the declaration's own lines to the subroutine too. the name follows the keyword and the return type
+    subroutineName = tokenizer.peek(2);
     writeLine("<subroutineDec>");
     writeXML();
+    SubroutineSummary unrecorded;
+    if (summarize)
+        classSummary.subroutines.push_back(SubroutineSummary());
+    SubroutineSummary &summary = summarize ? classSummary.subroutines.back() : unrecorded;
+    summary.kind = tokenizer.keyWord();
+    string name;
     while (!(tokenizer.tokenType() == SYMBOL && tokenizer.symbol() == '('))
     {
         tokenizer.advance();
+        //the first token is the return type, the last identifier before '(' is the subroutine name
+        if (summary.returnType.empty())
+            summary.returnType = tokenizer.tokenVal();
+        else if (tokenizer.tokenType() == IDENTIFIER)
+            name = tokenizer.identifier();
+        else if (tokenizer.tokenType() == SYMBOL && tokenizer.symbol() == '(')
+            subroutineName = summary.name = name;
         if (tokenizer.tokenType() == KEYWORD || tokenizer.tokenType() == SYMBOL || tokenizer.tokenType() == IDENTIFIER)
         {
             writeXML();
@@ -604,13 +2014,22 @@ void CompilationEngine::CompileSubroutineDec()
 void CompilationEngine::CompileParameterList()
 {
     writeLine("<parameterList>");
+    bool expectType = true;
     while (!(tokenizer.tokenType() == SYMBOL && tokenizer.symbol() == ')'))
     {
         tokenizer.advance();
         if (tokenizer.tokenType() == KEYWORD || tokenizer.tokenType() == IDENTIFIER)
         {
+            //parameters are "type name" pairs separated by ','
+            if (expectType && summarize)
+                classSummary.subroutines.back().parameterTypes.push_back(tokenizer.tokenVal());
+            expectType = false;
             writeXML();
         }
+        else if (tokenizer.tokenType() == SYMBOL && tokenizer.symbol() == ',')
+        {
+            expectType = true;
+        }
 
         if (tokenizer.tokenType() == SYMBOL && tokenizer.symbol() != ')')
         {
@@ -658,25 +2077,49 @@ void CompilationEngine::CompileStatements()
 
     while (!(tokenizer.tokenType() == SYMBOL && tokenizer.symbol() == '}'))
     {
-        switch (tokenizer.keyWord())
+        //the subroutine was not closed. CompileClass goes on with the class member
+        if (atClassMember())
         {
-        case IF:
-            CompileIf();
-            break;
-        case WHILE:
-            CompiileWhile();
-            break;
-        case DO:
-            CompiileDo();
-            break;
-        case LET:
-            CompiileLet();
-            break;
-        case RETURN:
-            CompiileReturn();
-            break;
+            tokenizer.rollBack();
+            throw runtime_error("expected '}'!");
+        }
+
+        int depth = openTags.size();
+        try
+        {
+            //the tokenizer returns a NULL token at the end of the input
+            if (tokenizer.tokenType() == NULL)
+                throw runtime_error("unexpected end of file!");
+
+            switch (tokenizer.tokenType() == KEYWORD ? tokenizer.keyWord() : INVALID)
+            {
+            case IF:
+                CompileIf();
+                break;
+            case WHILE:
+                CompiileWhile();
+                break;
+            case DO:
+                CompiileDo();
+                break;
+            case LET:
+                CompiileLet();
+                break;
+            case RETURN:
+                CompiileReturn();
+                break;
+            default:
+                throw runtime_error("expected a statement!");
+            }
+            tokenizer.advance();
+        }
+        catch (runtime_error &e)
+        {
+            //report the error and go on with the next statement
+            reportError(e.what());
+            closeTags(depth);
+            skipToStatement();
         }
-        tokenizer.advance();
     }
 
     writeLine("</statements>");
@@ -690,6 +2133,7 @@ void CompilationEngine::CompiileLet()
     {
 
         tokenizer.advance();
+        checkStatementEnd("expected ';'!");
         if (tokenizer.tokenType() == SYMBOL || tokenizer.tokenType() == IDENTIFIER)
         {
             writeXML();
@@ -733,6 +2177,10 @@ void CompilationEngine::CompileIf()
 
         writeXML(); // write '}'
     }
+    else
+    {
+        throw runtime_error("expected '(' after if!");
+    }
 
     tokenizer.advance();
     if (tokenizer.tokenType() == KEYWORD && tokenizer.keyWord() == ELSE)
@@ -781,6 +2229,10 @@ void CompilationEngine::CompiileWhile()
 
         writeXML(); // write '}'
     }
+    else
+    {
+        throw runtime_error("expected '(' after while!");
+    }
 
     writeLine("</whileStatement>");
 }
@@ -792,6 +2244,7 @@ void CompilationEngine::CompiileDo()
     while (!(tokenizer.tokenType() == SYMBOL && tokenizer.symbol() == ';'))
     {
         tokenizer.advance();
+        checkStatementEnd("expected ';'!");
 
         if (tokenizer.tokenType() == IDENTIFIER || tokenizer.tokenType() == SYMBOL || tokenizer.tokenType() == KEYWORD)
         {
@@ -854,6 +2307,17 @@ void CompilationEngine::CompiileExpression()
 //return token pointed to input token positon
 void CompilationEngine::CompileTerm()
 {
+    //a term is a constant, a variable, a call, or starts with '(', '-' or '~'
+    int type = tokenizer.tokenType();
+    bool value = type == INT_CONST || type == STRING_CONST || type == IDENTIFIER;
+    bool keywordConstant = type == KEYWORD && (tokenizer.keyWord() == TRUE || tokenizer.keyWord() == FALSE || tokenizer.keyWord() == NULL || tokenizer.keyWord() == THIS);
+    bool opening = type == SYMBOL && (tokenizer.symbol() == '(' || tokenizer.symbol() == '-' || tokenizer.symbol() == '~');
+    if (!(value || keywordConstant || opening))
+    {
+        checkStatementEnd("expected a term!");
+        throw runtime_error("expected a term!");
+    }
+
     writeLine("<term>");
     writeXML();
 
@@ -952,15 +2416,48 @@ class JackAnalyzer
 {
 private:
     string filepath;
+    CallGraph *callGraph;
+    bool sourceMap;
+    int jobs;
+    bool stream;
+    BatchIO *io;
+    bool summarize;
+    int errorCount = 0;
 
 public:
-    JackAnalyzer(string &path) : filepath(path){};
+    JackAnalyzer(string &path, CallGraph *cg = nullptr, bool map = false, int j = 1, bool st = false, BatchIO *bio = nullptr, bool sum = false) : filepath(path), callGraph(cg), sourceMap(map), jobs(j), stream(st), io(bio), summarize(sum){};
+
+    //returns the declarations of the compiled class, which are only recorded with summarize
+    ClassSummary beginAnalyzing()
+    {
+        if (io)
+        {
+            JackTokenizer tokenizer = tokenizeText(io->read(filepath));
+            return beginAnalyzing(tokenizer);
+        }
+        else
+        {
+            JackTokenizer tokenizer(filepath, stream);
+            return beginAnalyzing(tokenizer);
+        }
+    }
+
+    //compiles an already tokenized file, without reading it again.
+    //standard input ("-") is compiled to standard output
+    ClassSummary beginAnalyzing(JackTokenizer &tokenizer)
+    {
+        string outputPath = filepath == "-" ? filepath : filepath.substr(0, filepath.size() - 4) + "xml";
+        CompilationEngine engine(tokenizer, outputPath, callGraph, sourceMap, jobs, io, summarize);
+        for (Diagnostic &d : engine.diagnostics())
+            cerr << filepath << ":" << d.line << ":" << d.column << ": error: " << d.message << endl;
+        errorCount = engine.diagnostics().size();
+        return engine.summary();
+    }
 
-    void beginAnalyzing()
+    //the number of syntax errors found by the last beginAnalyzing
+    int errors()
     {
-        JackTokenizer tokenizer(filepath);
-        string outputPath = filepath.substr(0, filepath.size() - 4) + "xml";
-        CompilationEngine engine(tokenizer, outputPath);
+        return errorCount;
     }
 };
 
@@ -1011,20 +2508,200 @@ void getAllFiles(string path, vector<string> &files)
     }
 }
 
-int main()
+//usage: myJackCompilerXML [--whole-program] [--source-map] [--jobs n] [--stream] [--bundle-in file] [--bundle-out file]
+//                         [--emit-summary file] [--summary file]... [file.jack | directory | -]
+//--whole-program: only write subroutines reachable from Main.main
+//--source-map: write a .map file mapping each output line back to its .jack line and subroutine
+//--jobs n: compile the subroutines of a class on n threads
+//--stream: tokenize through a fixed size window instead of reading whole files. "-" reads standard input
+//--bundle-in file: read the .jack files from a bundle or tar archive instead of the input path
+//--bundle-out file: write all outputs into one bundle instead of one file per class
+//--emit-summary file: write the declarations of all compiled classes into a class summary file
+//--summary file: use the classes of a summary file in the whole-program analysis. can be given more than once
+int main(int argc, char *argv[])
 {
     vector<string> files;
 
     string inputPath = "C:/Users/skyri/projects/JackCompiler/SquareGame.jack";
+    bool wholeProgram = false;
+    bool sourceMap = false;
+    int jobs = 1;
+    bool stream = false;
+    string bundleIn;
+    string bundleOut;
+    string emitSummary;
+    vector<string> summaryFiles;
+
+    for (int i = 1; i < argc; i++)
+    {
+        string arg = argv[i];
+        if (arg == "--whole-program")
+            wholeProgram = true;
+        else if (arg == "--source-map")
+            sourceMap = true;
+        else if (arg == "--jobs" && i + 1 < argc)
+            jobs = max(1, atoi(argv[++i]));
+        else if (arg == "--stream")
+            stream = true;
+        else if (arg == "--bundle-in" && i + 1 < argc)
+            bundleIn = argv[++i];
+        else if (arg == "--bundle-out" && i + 1 < argc)
+            bundleOut = argv[++i];
+        else if (arg == "--emit-summary" && i + 1 < argc)
+            emitSummary = argv[++i];
+        else if (arg == "--summary" && i + 1 < argc)
+            summaryFiles.push_back(argv[++i]);
+        else
+            inputPath = arg;
+    }
+
+    //the call graph and the subroutine split need the whole input in memory
+    if (stream && (wholeProgram || jobs > 1))
+        throw runtime_error("--stream cannot be used with --whole-program or --jobs!");
+
+    //summaries are only used by the call graph
+    if (!summaryFiles.empty() && !wholeProgram)
+        throw runtime_error("--summary can only be used with --whole-program!");
+
+    //bundles are read and written by BatchIO
+    if ((stream || inputPath == "-") && (!bundleIn.empty() || !bundleOut.empty()))
+        throw runtime_error("bundles cannot be used with --stream or standard input!");
 
-    getAllFiles(inputPath, files);
+    vector<string> contents;
+    if (!bundleIn.empty())
+    {
+        vector<string> names;
+        vector<string> bundleContents;
+        try
+        {
+            readBundle(bundleIn, names, bundleContents);
+        }
+        catch (runtime_error &e)
+        {
+            cerr << bundleIn << ": error: " << e.what() << endl;
+            cerr << "1 errors" << endl;
+            return 1;
+        }
+        for (size_t i = 0; i < names.size(); i++)
+        {
+            if (checkjack(names[i]))
+            {
+                files.push_back(names[i]);
+                contents.push_back(bundleContents[i]);
+            }
+        }
+    }
+    else if (inputPath == "-")
+        files.push_back(inputPath);
+    else
+        getAllFiles(inputPath, files);
 
     if (files.size() == 0)
         throw runtime_error("no vaild input file!");
 
+    //files are read and written through BatchIO, except when streaming from a file or standard input
+    unique_ptr<BatchIO> io;
+    if (!bundleIn.empty())
+        io.reset(new BatchIO(files, contents));
+    else if (!stream && inputPath != "-")
+        io.reset(new BatchIO(files));
+
+    if (!bundleOut.empty())
+    {
+        //outputs are named relative to the input directory
+        string root;
+        if (bundleIn.empty())
+            root = checkjack(inputPath) ? inputPath.substr(0, inputPath.find_last_of("/\\") + 1) : inputPath + "/";
+        io->bundleOutput(bundleOut, root);
+    }
+
+    //a file that cannot be read is reported and skipped, the other files are still compiled
+    int errors = 0;
+    vector<bool> failed(files.size());
+
+    //whole-program mode tokenizes every file once and shares the tokens between the call graph and the compilation
+    CallGraph callGraph;
+    vector<JackTokenizer> tokenizers(files.size());
+    if (wholeProgram)
+    {
+        for (size_t i = 0; i < files.size(); i++)
+        {
+            try
+            {
+                if (io)
+                {
+                    tokenizers[i] = tokenizeText(io->read(files[i]));
+                }
+                else
+                {
+                    tokenizers[i] = JackTokenizer(files[i]);
+                }
+            }
+            catch (runtime_error &e)
+            {
+                cerr << files[i] << ": error: " << e.what() << endl;
+                errors++;
+                failed[i] = true;
+                continue;
+            }
+            callGraph.addFile(tokenizers[i]);
+        }
+        for (size_t i = 0; i < summaryFiles.size(); i++)
+        {
+            vector<ClassSummary> library;
+            try
+            {
+                readSummaries(summaryFiles[i], library);
+            }
+            catch (runtime_error &e)
+            {
+                cerr << summaryFiles[i] << ": error: " << e.what() << endl;
+                errors++;
+                continue;
+            }
+            for (ClassSummary &cls : library)
+                callGraph.addSummary(cls);
+        }
+        if (!callGraph.markLive("Main.main"))
+        {
+            cerr << "error: entry point Main.main is not declared, no subroutines are eliminated" << endl;
+            errors++;
+        }
+    }
+
+    vector<ClassSummary> summaries;
     for (int i = 0; i < files.size(); i++)
     {
-        JackAnalyzer analyzer(files[i]);
-        analyzer.beginAnalyzing();
+        if (failed[i])
+            continue;
+        JackAnalyzer analyzer(files[i], wholeProgram ? &callGraph : nullptr, sourceMap, jobs, stream, io.get(), !emitSummary.empty());
+        try
+        {
+            if (wholeProgram)
+                summaries.push_back(analyzer.beginAnalyzing(tokenizers[i]));
+            else
+                summaries.push_back(analyzer.beginAnalyzing());
+        }
+        catch (runtime_error &e)
+        {
+            cerr << files[i] << ": error: " << e.what() << endl;
+            errors++;
+        }
+        errors += analyzer.errors();
+    }
+
+    if (io)
+        io->finish();
+
+    if (!emitSummary.empty())
+        writeSummaries(emitSummary, summaries);
+
+    if (wholeProgram)
+        callGraph.report();
+
+    if (errors > 0)
+    {
+        cerr << errors << " errors" << endl;
+        return 1;
     }
 }
\ No newline at end of file